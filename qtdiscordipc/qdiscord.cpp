@@ -12,11 +12,9 @@
 #include <QMetaEnum>
 #include <QRegularExpression>
 
-struct MessageHeader {
-    uint32_t opcode;
-    uint32_t length;
-};
-static_assert(sizeof(MessageHeader) == 8);
+#include <utility>
+
+static const QStringList oauthScopes{"rpc", "identify"};
 
 double QDiscord::ipcToUIVolume(double v) {
     if(v <= 0)
@@ -37,287 +35,456 @@ double QDiscord::uiToIPCVolume(double v) {
 }
 
 QDiscord::QDiscord() {
+    connectTimer_.setSingleShot(true);
+    receiveTimer_.setSingleShot(true);
+
     QObject::connect(&socket_, &QLocalSocket::errorOccurred, this, [this](const QLocalSocket::LocalSocketError &err) {
+        // Nobody listening on this pipe -> try the next one
+        if(connectState_ == ConnectState::socketConnecting) {
+            connectPipe_++;
+            tryConnectPipe();
+            return;
+        }
+
         qWarning() << "QDiscord socket error: " << static_cast<int>(err);
     });
+    QObject::connect(&socket_, &QLocalSocket::connected, this, &QDiscord::onSocketConnected);
     QObject::connect(&socket_, &QLocalSocket::disconnected, this, [this] {
         qDebug() << "Disconnected";
         if(connectionError_.isEmpty())
             connectionError_ = "DISCONNECTED";
-        disconnect();
-    });
-    QObject::connect(&socket_, &QLocalSocket::readyRead, this, [this] {
-        if(blockingRead_)
-            return;
 
-        readAndProcessMessages();
-        if(socket_.bytesAvailable())
-            qDebug() << "ASSERTION FAILED: bytes still available after read and process messages";
+        if(connectState_ != ConnectState::idle)
+            failConnecting(connectionError_);
+        else
+            disconnect();
+    });
+    QObject::connect(&socket_, &QLocalSocket::readyRead, this, &QDiscord::readAndProcessMessages);
+    QObject::connect(&connectTimer_, &QTimer::timeout, this, &QDiscord::onConnectTimeout);
+    QObject::connect(&receiveTimer_, &QTimer::timeout, this, [this] {
+        qWarning() << "QDiscord - message receive timeout" << receiveHeaderBytes_ << receivePayloadBytes_;
+        dropCorruptedConnection();
     });
 }
 
 QDiscord::~QDiscord() {
+    // The socket can emit disconnected during its destruction, when the rest of the object is already gone
+    socket_.disconnect(this);
+
     for(const auto r: pendingReplies_)
         delete r;
 }
 
-bool QDiscord::connect(const QString &clientID, const QString &clientSecret) {
+void QDiscord::connectAsync(const QString &clientID, const QString &clientSecret, int pipeIndex) {
+    if(connectState_ != ConnectState::idle) {
+        qWarning() << "QDiscord - already connecting";
+        return;
+    }
+
+    disconnect();
+    socket_.abort();
     connectionError_.clear();
+
+    if(clientID.isEmpty() || clientSecret.isEmpty()) {
+        qDebug() << "Missing client ID or secret";
+        connectionError_ = "ERR 0";
+        emit connectionFailed();
+        return;
+    }
+
+    clientID_ = clientID;
+    clientSecret_ = clientSecret;
+    connectAttempt_++;
     processing_++;
-    const bool r = [&]() {
-        if(clientID.isEmpty() || clientSecret.isEmpty()) {
-            qDebug() << "Missing client ID or secret";
-            connectionError_ = "ERR 0";
-            return false;
-        }
 
-        // start connecting
-        for(int i = 0; i < 10; i++) {
-            socket_.disconnectFromServer();
-            socket_.connectToServer("discord-ipc-" + QString::number(i));
-            qDebug() << "Trying to connect to Discord (" << i << ")";
+    connectPipe_ = pipeIndex < 0 ? 0 : pipeIndex;
+    connectLastPipe_ = pipeIndex < 0 ? pipeCount - 1 : pipeIndex;
+    connectState_ = ConnectState::socketConnecting;
+    tryConnectPipe();
+}
 
-            if(socket_.waitForConnected(3000))
-                break;
-        }
-        if(socket_.state() != QLocalSocket::ConnectedState) {
-            qDebug() << "Connection failed";
-            connectionError_ = "ERR 1";
-            return false;
-        }
+bool QDiscord::connect(const QString &clientID, const QString &clientSecret, int pipeIndex) {
+    connectAsync(clientID, clientSecret, pipeIndex);
+
+    if(connectState_ != ConnectState::idle) {
+        QEventLoop l;
+        QObject::connect(this, &QDiscord::connected, &l, &QEventLoop::quit);
+        QObject::connect(this, &QDiscord::connectionFailed, &l, &QEventLoop::quit);
+        l.exec();
+    }
+
+    return isConnected_;
+}
+
+void QDiscord::tryConnectPipe() {
+    if(connectPipe_ > connectLastPipe_) {
+        qDebug() << "Connection failed";
+        failConnecting("ERR 1");
+        return;
+    }
+
+    qDebug() << "Trying to connect to Discord (" << connectPipe_ << ")";
+    connectTimer_.start(readTimeout_);
+
+    // Can synchronously emit connected or errorOccurred, so nothing can be done after this
+    socket_.abort();
+    socket_.connectToServer("discord-ipc-" + QString::number(connectPipe_));
+}
+
+void QDiscord::onSocketConnected() {
+    if(connectState_ != ConnectState::socketConnecting)
+        return;
+
+    qDebug() << "Connected";
+    pipeIndex_ = connectPipe_;
 
-        qDebug() << "Connected";
-        static const QStringList scopes{"rpc", "identify"};
+    // Handshake and dispatch Receive DISPATCH
+    connectState_ = ConnectState::handshake;
+    connectTimer_.start(readTimeout_);
+    sendMessage(QJsonObject{
+        {"v",         1},
+        {"client_id", clientID_},
+    }, 0);
+}
 
-        // Handshake and dispatch Receive DISPATCH
-        {
-            sendMessage(QJsonObject{
-                                    {"v",         1},
-                                    {"client_id", clientID},
-                                    }, 0);
+void QDiscord::onConnectTimeout() {
+    switch(connectState_) {
+        case ConnectState::socketConnecting:
+            connectPipe_++;
+            tryConnectPipe();
+            break;
+
+        case ConnectState::handshake:
+            qWarning() << "QDiscord - handshake timeout";
+            failConnecting("ERR 8");
+            break;
+
+        case ConnectState::authenticatingStored:
+            qDebug() << "Authentication with the stored token timed out";
+            startAuthorization();
+            break;
+
+        case ConnectState::authenticating:
+            qWarning() << "QDiscord - authentication timeout";
+            failConnecting("ERR 7");
+            break;
+
+        default:
+            break;
+    }
+}
 
-            const QDiscordMessage msg = readMessage();
+void QDiscord::processConnectMessage(const QDiscordMessage &msg) {
+    connectTimer_.stop();
 
+    switch(connectState_) {
+        case ConnectState::handshake: {
             if(msg.json.isEmpty()) {
                 qWarning() << "QDiscord - empty response" << msg.json;
-                connectionError_ = "ERR 8";
-                return false;
+                failConnecting("ERR 8");
+                return;
             }
 
-
             if(msg.json["cmd"] != "DISPATCH") {
                 qWarning() << "QDiscord - unexpected message (expected DISPATCH)" << msg.json["cmd"];
-                connectionError_ = "ERR 2";
-                return false;
+                failConnecting("ERR 2");
+                return;
             }
 
             cdn_ = msg.data["config"]["cdn_host"].toString();
-        }
-
-        QJsonObject oauthData;
-        QFile oauthFile("discordOauth.json");
-        if(oauthFile.exists()) {
-            oauthFile.open(QIODevice::ReadOnly);
-            oauthData = QJsonDocument::fromJson(oauthFile.readAll()).object();
-            oauthFile.close();
-        }
+            loadOAuthData(msg.data["user"]["id"].toString());
 
-        const auto saveOauthData = [&] {
-            oauthFile.open(QIODevice::WriteOnly);
-            oauthFile.write(QJsonDocument(oauthData).toJson(QJsonDocument::Compact));
-            oauthFile.close();
-        };
-
-        const auto loadIdentityFromAuth = [&](const QJsonObject &msg) {
-            userID_ = msg["data"]["user"]["id"].toString();
-        };
-
-        // Try refreshing token
-        if(!oauthData["refresh_token"].isNull()) {
-            QNetworkAccessManager nm;
-            QNetworkRequest req;
-            const QUrlQuery q{
-                              {"client_id",     clientID},
-                              {"client_secret", clientSecret},
-                              {"refresh_token", oauthData["refresh_token"].toString()},
-                              {"scope",         scopes.join(' ')},
-                              {"grant_type",    "refresh_token"},
-                              };
-            QUrl url("https://discord.com/api/oauth2/token");
-            req.setUrl(url);
-            req.setHeader(QNetworkRequest::ContentTypeHeader, "application/x-www-form-urlencoded");
-            auto r = nm.post(req, q.toString(QUrl::FullyEncoded).toUtf8());
-
-            QEventLoop l;
-            QObject::connect(r, &QNetworkReply::finished, &l, &QEventLoop::quit);
-
-            qDebug() << "REFRESH REQ" << req.url() << q.toString();
-
-            l.exec();
-            r->deleteLater();
-
-            if(r->error() == QNetworkReply::NoError) {
-                qDebug() << "Successfully refreshed token";
-                oauthData = QJsonDocument::fromJson(r->readAll()).object();
-                saveOauthData();
-            }
-            else {
-                connectionError_ = "ERR 3";
-                qWarning() << "QDiscord Network error (refresh)" << r->errorString();
+            // Try refreshing token
+            if(oauthData_["refresh_token"].isNull()) {
+                authenticateWithStoredToken();
+                return;
             }
+
+            connectState_ = ConnectState::refreshingToken;
+            QNetworkReply *r = postOAuthTokenRequest(QUrlQuery{
+                {"client_id",     clientID_},
+                {"client_secret", clientSecret_},
+                {"refresh_token", oauthData_["refresh_token"].toString()},
+                {"scope",         oauthScopes.join(' ')},
+                {"grant_type",    "refresh_token"},
+            });
+            QObject::connect(r, &QNetworkReply::finished, this, [this, r, attempt = connectAttempt_] {
+                r->deleteLater();
+                if(attempt != connectAttempt_ || connectState_ != ConnectState::refreshingToken)
+                    return;
+
+                if(r->error() == QNetworkReply::NoError) {
+                    qDebug() << "Successfully refreshed token";
+                    oauthData_ = QJsonDocument::fromJson(r->readAll()).object();
+                    saveOAuthData();
+                }
+                else {
+                    connectionError_ = "ERR 3";
+                    qWarning() << "QDiscord Network error (refresh)" << r->errorString();
+                }
+
+                authenticateWithStoredToken();
+            });
+            return;
         }
 
-        // Authenticate from stored token
-        if(!oauthData["access_token"].isNull()) {
-            sendMessage(QJsonObject{
-                                    {"cmd",   +CommandType::authenticate},
-                                    {"nonce", "auth_0"},
-                                    {"args",  QJsonObject{
-                                                 {"access_token", oauthData["access_token"].toString()}
-                                             }},
-                                    });
-
-            const QDiscordMessage msg = readMessage();
+        case ConnectState::authenticatingStored:
             if(msg.json["cmd"] == "AUTHENTICATE" && msg.json["evt"] != "ERROR") {
                 qDebug() << "Connected through pre-stored token";
-                loadIdentityFromAuth(msg.json);
-                return true;
+                userID_ = msg.data["user"]["id"].toString();
+                finishConnecting();
             }
-        }
+            else
+                startAuthorization();
+            return;
 
-        // When we got here, it mens that the automatic authentication on background failed -> start from scratch
-        oauthData = {};
-
-        // Send authorization request
-        {
-            // Authorize in Discord
-            QString authCode;
-            {
-                sendMessage(QJsonObject{
-                                        {"cmd",   +CommandType::authorize},
-                                        {"nonce", "auth_1"},
-                                        {"args",  QJsonObject{
-                                                     {"client_id", clientID},
-                                                     {"scopes",    QJsonArray::fromStringList(scopes)}
-                                                 }},
-                                        });
-
-                const QDiscordMessage msg = readMessage();
-                if(msg.json["cmd"] != "AUTHORIZE" || msg.json["evt"] == "ERROR") {
-                    connectionError_ = "ERR 4";
-                    qWarning() << "AUTHORIZE ERROR" << msg.json;
-                    return false;
-                }
+        case ConnectState::authorizing:
+            if(msg.json["cmd"] != "AUTHORIZE" || msg.json["evt"] == "ERROR") {
+                qWarning() << "AUTHORIZE ERROR" << msg.json;
+                failConnecting("ERR 4");
+                return;
+            }
 
-                authCode = msg.data["code"].toString();
+            requestAccessToken(msg.data["code"].toString());
+            return;
+
+        case ConnectState::authenticating:
+            if(msg.json["cmd"] != "AUTHENTICATE" || msg.json["evt"] == "ERROR") {
+                qWarning() << "AUTHENTICATE ERROR" << msg.json;
+                failConnecting("ERR 7");
+                return;
             }
 
-            // Get access token
-            {
-                QNetworkAccessManager nm;
-                QNetworkRequest req;
-                const QUrlQuery q{
-                                  {"client_id",     clientID},
-                                  {"client_secret", clientSecret},
-                                  {"code",          authCode},
-                                  {"scope",         scopes.join(' ')},
-                                  {"grant_type",    "authorization_code"},
-                                  };
-                QUrl url("https://discord.com/api/oauth2/token");
-                req.setUrl(url);
-                req.setHeader(QNetworkRequest::ContentTypeHeader, "application/x-www-form-urlencoded");
-                auto r = nm.post(req, q.toString(QUrl::FullyEncoded).toUtf8());
-
-                QEventLoop l;
-                QObject::connect(r, &QNetworkReply::finished, &l, &QEventLoop::quit);
-
-                qDebug() << "AUTH REQ" << req.url() << q.toString();
-
-                l.exec();
-                r->deleteLater();
+            userID_ = msg.data["user"]["id"].toString();
+            finishConnecting();
+            return;
 
-                if(r->error() != QNetworkReply::NoError) {
-                    connectionError_ = "ERR 5";
-                    qWarning() << "QDiscord Network error" << r->errorString();
-                    return false;
-                }
+        default:
+            qDebug() << "QDiscord - unexpected message while connecting" << msg.json;
+            return;
+    }
+}
 
-                oauthData = QJsonDocument::fromJson(r->readAll()).object();
-            }
+void QDiscord::authenticateWithStoredToken() {
+    if(oauthData_["access_token"].isNull()) {
+        startAuthorization();
+        return;
+    }
 
-            if(oauthData["access_token"].toString().isEmpty()) {
-                connectionError_ = "ERR 6";
-                qWarning() << "QDiscord failed to obtain access token";
-                return false;
-            }
+    connectState_ = ConnectState::authenticatingStored;
+    connectTimer_.start(readTimeout_);
+    sendMessage(QJsonObject{
+        {"cmd",   +CommandType::authenticate},
+        {"nonce", "auth_0"},
+        {"args",  QJsonObject{
+            {"access_token", oauthData_["access_token"].toString()}
+        }},
+    });
+}
 
-            saveOauthData();
-        }
+void QDiscord::startAuthorization() {
+    // When we got here, it mens that the automatic authentication on background failed -> start from scratch
+    oauthData_ = {};
+
+    // No timeout - waits for the user to confirm the prompt in the Discord
+    connectState_ = ConnectState::authorizing;
+    sendMessage(QJsonObject{
+        {"cmd",   +CommandType::authorize},
+        {"nonce", "auth_1"},
+        {"args",  QJsonObject{
+            {"client_id", clientID_},
+            {"scopes",    QJsonArray::fromStringList(oauthScopes)}
+        }},
+    });
+}
 
-        // Authenticate
-        {
-            sendMessage(QJsonObject{
-                                    {"cmd",   "AUTHENTICATE"},
-                                    {"nonce", "auth_2"},
-                                    {"args",  QJsonObject{
-                                                 {"access_token", oauthData["access_token"].toString()}
-                                             }},
-                                    });
-
-            const QDiscordMessage msg = readMessage();
-            if(msg.json["cmd"] != "AUTHENTICATE" || msg.json["evt"] == "ERROR") {
-                connectionError_ = "ERR 7";
-                qWarning() << "AUTHENTICATE ERROR" << msg.json;
-                return false;
-            }
+void QDiscord::requestAccessToken(const QString &authCode) {
+    connectState_ = ConnectState::requestingToken;
+    QNetworkReply *r = postOAuthTokenRequest(QUrlQuery{
+        {"client_id",     clientID_},
+        {"client_secret", clientSecret_},
+        {"code",          authCode},
+        {"scope",         oauthScopes.join(' ')},
+        {"grant_type",    "authorization_code"},
+    });
+    QObject::connect(r, &QNetworkReply::finished, this, [this, r, attempt = connectAttempt_] {
+        r->deleteLater();
+        if(attempt != connectAttempt_ || connectState_ != ConnectState::requestingToken)
+            return;
 
-            loadIdentityFromAuth(msg.json);
+        if(r->error() != QNetworkReply::NoError) {
+            qWarning() << "QDiscord Network error" << r->errorString();
+            failConnecting("ERR 5");
+            return;
         }
 
-        qDebug() << "Connection successful";
-        return true;
-    }();
+        oauthData_ = QJsonDocument::fromJson(r->readAll()).object();
+        if(oauthData_["access_token"].toString().isEmpty()) {
+            qWarning() << "QDiscord failed to obtain access token";
+            failConnecting("ERR 6");
+            return;
+        }
+
+        saveOAuthData();
+
+        connectState_ = ConnectState::authenticating;
+        connectTimer_.start(readTimeout_);
+        sendMessage(QJsonObject{
+            {"cmd",   +CommandType::authenticate},
+            {"nonce", "auth_2"},
+            {"args",  QJsonObject{
+                {"access_token", oauthData_["access_token"].toString()}
+            }},
+        });
+    });
+}
 
-    if(!r)
-        disconnect();
+QNetworkReply *QDiscord::postOAuthTokenRequest(const QUrlQuery &query) {
+    QNetworkRequest req(QUrl("https://discord.com/api/oauth2/token"));
+    req.setHeader(QNetworkRequest::ContentTypeHeader, "application/x-www-form-urlencoded");
+
+    qDebug() << "OAUTH REQ" << req.url() << query.toString();
+
+    return netMgr_.post(req, query.toString(QUrl::FullyEncoded).toUtf8());
+}
 
-    else {
-        isConnected_ = true;
-        connectionError_.clear();
-        emit connected();
+void QDiscord::loadOAuthData(const QString &userID) {
+    oauthFileName_ = QString(oauthFilePath_).replace("%1", userID);
+    oauthData_ = {};
+
+    QFile oauthFile(oauthFileName_);
+    if(oauthFile.exists()) {
+        oauthFile.open(QIODevice::ReadOnly);
+        oauthData_ = QJsonDocument::fromJson(oauthFile.readAll()).object();
+        oauthFile.close();
     }
+}
+
+void QDiscord::saveOAuthData() {
+    QFile oauthFile(oauthFileName_);
+    oauthFile.open(QIODevice::WriteOnly);
+    oauthFile.write(QJsonDocument(oauthData_).toJson(QJsonDocument::Compact));
+    oauthFile.close();
+}
 
+void QDiscord::finishConnecting() {
+    connectState_ = ConnectState::idle;
+    connectTimer_.stop();
     processing_--;
-    return r;
+
+    qDebug() << "Connection successful";
+    isConnected_ = true;
+    connectionError_.clear();
+    emit connected();
+}
+
+void QDiscord::failConnecting(const QString &error) {
+    if(connectState_ == ConnectState::idle)
+        return;
+
+    connectState_ = ConnectState::idle;
+    connectTimer_.stop();
+    processing_--;
+
+    connectionError_ = error;
+    socket_.abort();
+    disconnect();
+
+    emit connectionFailed();
 }
 
 void QDiscord::disconnect() {
-    const bool wasConnected = isConnected_;
+    if(connectState_ != ConnectState::idle) {
+        failConnecting("DISCONNECTED");
+        return;
+    }
+
+    // Cleared before disconnectFromServer, which can synchronously get back here through the socket disconnected signal
+    const bool wasConnected = std::exchange(isConnected_, false);
 
     socket_.disconnectFromServer();
-    isConnected_ = false;
     userID_.clear();
+    userVoiceSettings_.clear();
+
+    receiveHeaderBytes_ = 0;
+    receivePayloadBytes_ = 0;
+    receiveBuffer_.clear();
+    receiveTimer_.stop();
+
+    // Nobody is going to answer the pending commands anymore
+    const auto pendingReplies = std::exchange(pendingReplies_, {});
+    for(QDiscordReply *r: pendingReplies) {
+        emit r->finished(QDiscordMessage::fromJson(QJsonObject{
+            {"evt",   "ERROR"},
+            {"nonce", r->nonce()},
+            {"data",  QJsonObject{
+                {"code",    -1},
+                {"message", "Disconnected"},
+            }},
+        }));
+        r->deleteLater();
+    }
 
     if(wasConnected)
         emit disconnected();
+
+    // Reset after emitting so that the handlers can tell which pipe got disconnected - unless they have already started connecting again
+    if(!isConnected_ && connectState_ == ConnectState::idle)
+        pipeIndex_ = -1;
 }
 
 QDiscordReply *QDiscord::sendCommand(const QString &command, const QJsonObject &args, const QJsonObject &msgOverrides) {
-    const QString nonce = QStringLiteral("%1:%2").arg(QString::number(nonceCounter_++), QString::number(QRandomGenerator64::global()->generate()));
-    QJsonObject message{
-        {"cmd",   command},
-        {"args",  args},
-        {"nonce", nonce}
-    };
+    QByteArray data;
+    QDiscordReply *r = composeCommand(data, command, args, msgOverrides);
+    socket_.write(data);
+    return r;
+}
 
-    for(auto it = msgOverrides.begin(), end = msgOverrides.end(); it != end; it++)
-        message[it.key()] = it.value();
+QList<QDiscordReply *> QDiscord::setUsersVoiceSettings(const QHash<QString, UserVoiceSettings> &snapshot) {
+    // Volumes closer than this (in the UI scale) are considered the same - the values do a round trip through the IPC scale
+    static constexpr double volumeTolerance = 0.01;
 
-    sendMessage(message);
+    // The commands would never get a reply and the assumed settings would stick in the cache
+    if(!isConnected_)
+        return {};
 
-    QDiscordReply *r = new QDiscordReply(nonce);
-    pendingReplies_.insert(nonce, r);
-    return r;
+    QList<QDiscordReply *> result;
+    QByteArray data;
+
+    for(auto it = snapshot.begin(), end = snapshot.end(); it != end; it++) {
+        const QString &userID = it.key();
+
+        UserVoiceSettings target = it.value();
+        target.volume = qBound<double>(minVoiceVolume, target.volume, maxVoiceVolume);
+
+        const auto current = userVoiceSettings_.constFind(userID);
+        if(current != userVoiceSettings_.constEnd() && current->mute == target.mute && qAbs(current->volume - target.volume) < volumeTolerance)
+            continue;
+
+        QDiscordReply *r = composeCommand(data, +CommandType::setUserVoiceSettings, QJsonObject{
+            {"user_id", userID},
+            {"volume",  uiToIPCVolume(target.volume)},
+            {"mute",    target.mute},
+        });
+
+        // Assume the command succeeds so that repeated snapshots don't resend it; forget the state if it doesn't
+        userVoiceSettings_.insert(userID, target);
+        QObject::connect(r, &QDiscordReply::error, this, [this, userID, target] {
+            // Keep the state if a newer command or event has changed it in the meantime
+            const auto current = userVoiceSettings_.constFind(userID);
+            if(current != userVoiceSettings_.constEnd() && current->volume == target.volume && current->mute == target.mute)
+                userVoiceSettings_.remove(userID);
+        });
+
+        result += r;
+    }
+
+    if(!data.isEmpty()) {
+        socket_.write(data);
+        socket_.flush();
+    }
+
+    return result;
 }
 
 QImage QDiscord::getUserAvatar(const QString &userId, const QString &avatarId) {
@@ -336,29 +503,13 @@ QImage QDiscord::getUserAvatar(const QString &userId, const QString &avatarId) {
     return {};
 }
 
-QDiscordMessage QDiscord::readMessage() {
-    const QByteArray headerBA = blockingReadBytes(sizeof(MessageHeader));
-    if(headerBA.isNull()) {
-        qDebug() << "Empty json message";
-        return {};
-    }
-
-    const MessageHeader &header = *reinterpret_cast<const MessageHeader *>(headerBA.data());
-
-    const QByteArray data = blockingReadBytes(static_cast<int>(header.length));
-
-    QJsonParseError err;
-    QDiscordMessage result = QDiscordMessage::fromJson(QJsonDocument::fromJson(data, &err).object(), static_cast<int>(header.opcode));
-
-    if(err.error != QJsonParseError::NoError)
-        qWarning() << "QDiscord - failed to parse message\n\n" << data;
-
-    qDebug() << "<<<<< RECV\n" << header.opcode << header.length << result.json << "\n";
-
-    return result;
+void QDiscord::sendMessage(const QJsonObject &packet, int opCode) {
+    QByteArray data;
+    composeMessage(data, packet, opCode);
+    socket_.write(data);
 }
 
-void QDiscord::sendMessage(const QJsonObject &packet, int opCode) {
+void QDiscord::composeMessage(QByteArray &target, const QJsonObject &packet, int opCode) {
     const QByteArray payload = QJsonDocument(packet).toJson(QJsonDocument::Compact);
 
     qDebug() << ">>>>> SEND\n" << opCode << payload.length() << packet << "\n";
@@ -367,11 +518,36 @@ void QDiscord::sendMessage(const QJsonObject &packet, int opCode) {
     header.opcode = static_cast<uint32_t>(opCode);
     header.length = static_cast<uint32_t>(payload.length());
 
-    socket_.write(QByteArray::fromRawData(reinterpret_cast<const char *>(&header), sizeof(MessageHeader)));
-    socket_.write(payload);
+    target.append(reinterpret_cast<const char *>(&header), sizeof(MessageHeader));
+    target.append(payload);
+}
+
+QDiscordReply *QDiscord::composeCommand(QByteArray &target, const QString &command, const QJsonObject &args, const QJsonObject &msgOverrides) {
+    const QString nonce = QStringLiteral("%1:%2").arg(QString::number(nonceCounter_++), QString::number(QRandomGenerator64::global()->generate()));
+    QJsonObject message{
+        {"cmd",   command},
+        {"args",  args},
+        {"nonce", nonce}
+    };
+
+    for(auto it = msgOverrides.begin(), end = msgOverrides.end(); it != end; it++)
+        message[it.key()] = it.value();
+
+    composeMessage(target, message);
+
+    QDiscordReply *r = new QDiscordReply(nonce);
+    pendingReplies_.insert(nonce, r);
+    return r;
 }
 
 void QDiscord::processMessage(const QDiscordMessage &msg) {
+    if(connectState_ != ConnectState::idle) {
+        processConnectMessage(msg);
+        return;
+    }
+
+    updateUserVoiceSettings(msg);
+
     if(QDiscordReply *r = pendingReplies_.take(msg.nonce)) {
         emit r->finished(msg);
         r->deleteLater();
@@ -381,26 +557,126 @@ void QDiscord::processMessage(const QDiscordMessage &msg) {
     emit messageReceived(msg);
 }
 
-QByteArray QDiscord::blockingReadBytes(int bytes) {
-    blockingRead_++;
-    processing_++;
-    while(socket_.bytesAvailable() < bytes) {
-        if(!socket_.waitForReadyRead(3000)) {
-            qWarning() << "QDiscord - waitForReadyRead timeout" << socket_.bytesAvailable();
-            processing_--;
-            blockingRead_--;
-            return {};
+void QDiscord::updateUserVoiceSettings(const QDiscordMessage &msg) {
+    const auto update = [this](const QString &userID, const QJsonObject &obj) {
+        if(userID.isEmpty())
+            return;
+
+        userVoiceSettings_.insert(userID, UserVoiceSettings{
+            .volume = ipcToUIVolume(obj["volume"].toDouble()),
+            .mute = obj["mute"].toBool(),
+        });
+    };
+
+    switch(msg.event) {
+        case QDiscordMessage::EventType::voiceStateCreate:
+        case QDiscordMessage::EventType::voiceStateUpdate:
+            update(msg.data["user"]["id"].toString(), msg.data);
+            return;
+
+        case QDiscordMessage::EventType::voiceStateDelete:
+            userVoiceSettings_.remove(msg.data["user"]["id"].toString());
+            return;
+
+        case QDiscordMessage::EventType::error:
+            return;
+
+        default:
+            break;
+    }
+
+    // GET_CHANNEL, GET_SELECTED_VOICE_CHANNEL
+    if(msg.data.contains("voice_states")) {
+        for(const QJsonValue &v: msg.data["voice_states"].toArray()) {
+            const QJsonObject vs = v.toObject();
+            update(vs["user"]["id"].toString(), vs);
         }
     }
-    processing_--;
-    blockingRead_--;
 
-    return socket_.read(bytes);
+    else if(msg.json["cmd"].toString() == +CommandType::setUserVoiceSettings)
+        update(msg.data["user_id"].toString(), msg.data);
+}
+
+QDiscordMessage QDiscord::takeReceivedMessage() {
+    QJsonParseError err;
+    QDiscordMessage result = QDiscordMessage::fromJson(QJsonDocument::fromJson(receiveBuffer_, &err).object(), static_cast<int>(receiveHeader_.opcode));
+
+    if(err.error != QJsonParseError::NoError)
+        qWarning() << "QDiscord - failed to parse message\n\n" << receiveBuffer_;
+
+    qDebug() << "<<<<< RECV\n" << receiveHeader_.opcode << receiveHeader_.length << result.json << "\n";
+
+    receiveHeaderBytes_ = 0;
+    receivePayloadBytes_ = 0;
+
+    // Don't keep the memory from a large spike (GET_GUILDS, ...) around
+    if(receiveBuffer_.capacity() > receiveBufferRetainSize)
+        receiveBuffer_.clear();
+
+    return result;
+}
+
+void QDiscord::dropCorruptedConnection() {
+    qWarning() << "QDiscord - corrupted data stream, dropping connection";
+    if(connectState_ != ConnectState::idle) {
+        failConnecting("ERR 9");
+        return;
+    }
+
+    connectionError_ = "ERR 9";
+
+    // abort() also discards whatever is left in the read buffer
+    socket_.abort();
+    disconnect();
 }
 
 void QDiscord::readAndProcessMessages() {
-    while(socket_.bytesAvailable())
-        processMessage(readMessage());
+    static constexpr int headerSize = sizeof(MessageHeader);
+
+    while(socket_.state() == QLocalSocket::ConnectedState) {
+        if(receiveHeaderBytes_ < headerSize) {
+            const qint64 r = socket_.read(reinterpret_cast<char *>(&receiveHeader_) + receiveHeaderBytes_, headerSize - receiveHeaderBytes_);
+            if(r <= 0)
+                break;
+
+            // A reply is arriving during connecting; if it stalls, receiveTimer_ takes care of it
+            connectTimer_.stop();
+
+            receiveHeaderBytes_ += static_cast<int>(r);
+            if(receiveHeaderBytes_ < headerSize)
+                break;
+
+            // Discord only uses opcodes 0-4 (handshake, frame, close, ping, pong); anything else (or an absurd length) means we're out of sync
+            if(receiveHeader_.opcode > 4 || receiveHeader_.length > static_cast<uint32_t>(maxMessageSize_)) {
+                qWarning() << "QDiscord - invalid message header" << receiveHeader_.opcode << receiveHeader_.length;
+                dropCorruptedConnection();
+                return;
+            }
+
+            receiveBuffer_.resize(static_cast<int>(receiveHeader_.length));
+            receivePayloadBytes_ = 0;
+        }
+
+        // Take the payload as it arrives so that the socket doesn't buffer the whole message next to receiveBuffer_
+        const int length = static_cast<int>(receiveHeader_.length);
+        if(receivePayloadBytes_ < length) {
+            const qint64 r = socket_.read(receiveBuffer_.data() + receivePayloadBytes_, length - receivePayloadBytes_);
+            if(r <= 0)
+                break;
+
+            receivePayloadBytes_ += static_cast<int>(r);
+            if(receivePayloadBytes_ < length)
+                break;
+        }
+
+        processMessage(takeReceivedMessage());
+    }
+
+    // Wait at most readTimeout_ for the rest of a partially received message
+    if(receiveHeaderBytes_ > 0 && socket_.state() == QLocalSocket::ConnectedState)
+        receiveTimer_.start(readTimeout_);
+    else
+        receiveTimer_.stop();
 }
 
 QString operator +(QDiscord::CommandType ct) {
@@ -8,6 +8,8 @@
 #include <QImage>
 #include <QCache>
 #include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QUrlQuery>
 
 #include "qdiscordmessage.h"
 #include "qdiscordreply.h"
@@ -19,6 +21,15 @@ public:
 	static constexpr float minVoiceVolume = 0;
 	static constexpr float maxVoiceVolume = 200;
 
+	/// Discord listens on the first free of discord-ipc-0 .. discord-ipc-9
+	static constexpr int pipeCount = 10;
+
+	/// Default limit for a single received message payload (see setMaxMessageSize)
+	static constexpr int defaultMaxMessageSize = 16 * 1024 * 1024;
+
+	/// Receive buffer capacity that is kept between messages; larger allocations are released after the message is processed
+	static constexpr int receiveBufferRetainSize = 64 * 1024;
+
 public:
 	enum class CommandType {
 		unknown = -1,
@@ -49,6 +60,12 @@ public:
 
 	Q_ENUM(CommandType);
 
+	/// Voice settings of a single user; the volume is in the Discord UI scale (minVoiceVolume - maxVoiceVolume)
+	struct UserVoiceSettings {
+		double volume = 100;
+		bool mute = false;
+	};
+
 public:
 	QDiscord();
 	~QDiscord();
@@ -62,9 +79,15 @@ public:
 
 public:
 	/**
-	 * Tries to connext to the Discord. Returns true if successfull (this function is blocking)
+	 * Starts connecting to the Discord, finishes asynchronously with either connected or connectionFailed.
+	 * If $pipeIndex is -1, connects to the first Discord instance that answers; otherwise only to discord-ipc-$pipeIndex
+	 */
+	void connectAsync(const QString &clientID, const QString &clientSecret, int pipeIndex = -1);
+
+	/**
+	 * Tries to connext to the Discord. Returns true if successfull (this function is blocking - runs a local event loop until connectAsync finishes)
 	 */
-	bool connect(const QString &clientID, const QString &clientSecret);
+	bool connect(const QString &clientID, const QString &clientSecret, int pipeIndex = -1);
 
 	void disconnect();
 
@@ -72,6 +95,10 @@ public:
 		return isConnected_;
 	}
 
+	inline bool isConnecting() const {
+		return connectState_ != ConnectState::idle;
+	}
+
 	inline const QString &connectionError() const {
 		return connectionError_;
 	}
@@ -80,11 +107,51 @@ public:
 		return userID_;
 	}
 
-	/// Returns whether the discord is processing something (connecting, waiting for message, ...)
+	/// Index of the discord-ipc pipe the connection is made through, -1 if not connected (still valid in the disconnected signal handlers)
+	inline int pipeIndex() const {
+		return pipeIndex_;
+	}
+
+	inline const QString &oauthFilePath() const {
+		return oauthFilePath_;
+	}
+
+	/// Sets the file the OAuth data is stored in (discordOauth.json by default)
+	/// %1 in the path is replaced with the ID of the user logged in the Discord client, so that different accounts don't share the file
+	inline void setOAuthFilePath(const QString &set) {
+		oauthFilePath_ = set;
+	}
+
+	/// Returns whether the discord is processing something (connecting, ...)
 	inline bool isProcessing() const {
 		return processing_ > 0;
 	}
 
+	inline int maxMessageSize() const {
+		return maxMessageSize_;
+	}
+
+	/// Sets the maximum accepted payload size of a received message.
+	/// Receiving a message with a larger (or otherwise corrupted) header drops the connection.
+	inline void setMaxMessageSize(int set) {
+		Q_ASSERT(set > 0);
+		maxMessageSize_ = qMax(set, 1);
+	}
+
+	inline int readTimeout() const {
+		return readTimeout_;
+	}
+
+	/// Sets how long (ms) to wait for a reply or for the rest of a partially received message (3000 by default)
+	inline void setReadTimeout(int set) {
+		readTimeout_ = set;
+	}
+
+	/// Current capacity of the internal receive buffer (for diagnostics)
+	inline qsizetype receiveBufferCapacity() const {
+		return receiveBuffer_.capacity();
+	}
+
 public:
 	/**
 	 * Sends a command. Asynchronously returns the result via QDiscordReply::finished
@@ -93,6 +160,19 @@ public:
 	 */
 	QDiscordReply *sendCommand(const QString &command, const QJsonObject &args = {}, const QJsonObject &msgOverrides = {});
 
+	/**
+	 * Applies voice settings to multiple users at once (userID -> settings).
+	 * Only users whose settings differ from the last known state are sent, all the commands are written in one go.
+	 * Volumes are clamped to minVoiceVolume - maxVoiceVolume.
+	 * Returns replies for the commands that were actually sent (none if not connected).
+	 */
+	QList<QDiscordReply *> setUsersVoiceSettings(const QHash<QString, UserVoiceSettings> &snapshot);
+
+	/// Last known voice settings of the users (userID -> settings), tracked from the voice state events and command replies
+	inline const QHash<QString, UserVoiceSettings> &userVoiceSettings() const {
+		return userVoiceSettings_;
+	}
+
 public:
 	/// The function can be async, the avatar loading can be delayed and then signalled using avatarReady
 	QImage getUserAvatar(const QString &userId, const QString &avatarId);
@@ -105,24 +185,85 @@ signals:
 
 	void connected();
 
+	/// Emitted when connecting fails, connectionError() holds the reason
+	void connectionFailed();
+
 	void disconnected();
 
 private:
-	/// Blockingly reads a single message.
-	QDiscordMessage readMessage();
+	enum class ConnectState {
+		idle,
+		socketConnecting,
+		handshake,
+		refreshingToken,
+		authenticatingStored,
+		authorizing,
+		requestingToken,
+		authenticating,
+	};
+
+	struct MessageHeader {
+		uint32_t opcode;
+		uint32_t length;
+	};
+	static_assert(sizeof(MessageHeader) == 8);
+
+private:
+	/// Tries connecting the socket to connectPipe_, moves on to the next pipe on failure
+	void tryConnectPipe();
+
+	void onSocketConnected();
+
+	void onConnectTimeout();
+
+	/// Processes messages received during connecting (handshake and authentication)
+	void processConnectMessage(const QDiscordMessage &msg);
+
+	/// Sends AUTHENTICATE with the stored access token (if there is one)
+	void authenticateWithStoredToken();
+
+	/// Asks the user to authorize the app in the Discord
+	void startAuthorization();
+
+	/// Exchanges the authorization code for the access token and authenticates with it
+	void requestAccessToken(const QString &authCode);
+
+	QNetworkReply *postOAuthTokenRequest(const QUrlQuery &query);
 
+	/// Loads the OAuth data for the given user (see setOAuthFilePath)
+	void loadOAuthData(const QString &userID);
+
+	void saveOAuthData();
+
+	void finishConnecting();
+
+	void failConnecting(const QString &error);
+
+private:
 	void sendMessage(const QJsonObject &packet, int opCode = 1);
 
+	/// Appends header + payload of the message to target
+	void composeMessage(QByteArray &target, const QJsonObject &packet, int opCode = 1);
+
+	/// Appends the command message to target and registers a reply for it
+	QDiscordReply *composeCommand(QByteArray &target, const QString &command, const QJsonObject &args, const QJsonObject &msgOverrides = {});
+
 	/**
  * Processes incoming messages.
  */
 	void processMessage(const QDiscordMessage &msg);
 
+	/// Updates userVoiceSettings_ from voice state events and replies that contain voice states
+	void updateUserVoiceSettings(const QDiscordMessage &msg);
+
 private:
-	/// Blocking waits until given amount of bytes is available
-	QByteArray blockingReadBytes(int bytes);
+	/// Parses the completely received message and resets the receive state
+	QDiscordMessage takeReceivedMessage();
+
+	/// Aborts the connection because the incoming data stream cannot be trusted anymore
+	void dropCorruptedConnection();
 
-	/// Non-blocking processes received messsages
+	/// Non-blocking processes received messsages; partially received message is kept for the next call
 	void readAndProcessMessages();
 
 private:
@@ -131,14 +272,36 @@ private:
 	QString connectionError_;
 	QString userID_;
 	QString cdn_;
+	QString oauthFilePath_ = "discordOauth.json";
+	int pipeIndex_ = -1;
 	int nonceCounter_ = 0;
-	int blockingRead_ = 0;
 	int processing_ = 0;
+	int maxMessageSize_ = defaultMaxMessageSize;
+	int readTimeout_ = 3000;
+
+	/// Reused for all received payloads to avoid allocation per message
+	QByteArray receiveBuffer_;
+	MessageHeader receiveHeader_;
+	int receiveHeaderBytes_ = 0, receivePayloadBytes_ = 0;
+	QTimer receiveTimer_;
+
+private:
+	ConnectState connectState_ = ConnectState::idle;
+	int connectPipe_ = 0, connectLastPipe_ = 0;
+
+	/// Increased with each connectAsync call, so that replies from older attempts can be ignored
+	int connectAttempt_ = 0;
+
+	QTimer connectTimer_;
+	QString clientID_, clientSecret_;
+	QString oauthFileName_;
+	QJsonObject oauthData_;
 
 private:
 	QNetworkAccessManager netMgr_;
 	QCache<QString, QImage> avatarsCache_;
 	QHash<QString, QDiscordReply *> pendingReplies_;
+	QHash<QString, UserVoiceSettings> userVoiceSettings_;
 
 };
 
@@ -0,0 +1,111 @@
+#include "qdiscordpool.h"
+
+#include <QEventLoop>
+
+void QDiscordPool::connectAsync(const QString &clientID, const QString &clientSecret) {
+	// Instances can fail synchronously, connectFinished must not be emitted before all of them are started
+	isStartingConnects_ = true;
+
+	for(int i = 0; i < QDiscord::pipeCount; i++) {
+		QDiscord *d = instances_.value(i);
+		if(d && (d->isConnected() || d->isConnecting()))
+			continue;
+
+		if(!d) {
+			d = new QDiscord();
+			d->setParent(this);
+			d->setOAuthFilePath("discordOauth_%1.json");
+
+			QObject::connect(d, &QDiscord::messageReceived, this, [this, d](const QDiscordMessage &msg) {
+				emit messageReceived(d, msg);
+			});
+			QObject::connect(d, &QDiscord::connected, this, [this, d] {
+				emit instanceConnected(d);
+				onConnectAttemptFinished(d);
+			});
+			QObject::connect(d, &QDiscord::disconnected, this, [this, d] {
+				emit instanceDisconnected(d);
+			});
+			QObject::connect(d, &QDiscord::connectionFailed, this, [this, d, i] {
+				// Most likely no Discord running on the pipe; the instance gets created again on the next connect
+				instances_.remove(i);
+				d->deleteLater();
+				onConnectAttemptFinished(d);
+			});
+
+			// Insert before connecting so that the instance is accessible from the instanceConnected handlers
+			instances_.insert(i, d);
+		}
+
+		connectingInstances_.insert(d);
+
+		// Missing pipes fail right away in the socket connect; only running clients go through the handshake
+		d->connectAsync(clientID, clientSecret, i);
+	}
+
+	isStartingConnects_ = false;
+	onConnectAttemptFinished(nullptr);
+}
+
+int QDiscordPool::connect(const QString &clientID, const QString &clientSecret) {
+	connectAsync(clientID, clientSecret);
+
+	if(isConnecting()) {
+		QEventLoop l;
+		QObject::connect(this, &QDiscordPool::connectFinished, &l, &QEventLoop::quit);
+		l.exec();
+	}
+
+	return instances().size();
+}
+
+void QDiscordPool::disconnect() {
+	for(QDiscord *d: instances_)
+		d->disconnect();
+}
+
+QList<QDiscord *> QDiscordPool::instances() const {
+	QList<QDiscord *> r;
+	for(QDiscord *d: instances_) {
+		if(d->isConnected())
+			r += d;
+	}
+	return r;
+}
+
+QDiscord *QDiscordPool::instance(int pipeIndex) const {
+	QDiscord *d = instances_.value(pipeIndex);
+	return d && d->isConnected() ? d : nullptr;
+}
+
+bool QDiscordPool::isProcessing() const {
+	for(QDiscord *d: instances_) {
+		if(d->isProcessing())
+			return true;
+	}
+	return false;
+}
+
+QDiscordReply *QDiscordPool::sendCommand(int pipeIndex, const QString &command, const QJsonObject &args, const QJsonObject &msgOverrides) {
+	QDiscord *d = instance(pipeIndex);
+	if(!d)
+		return nullptr;
+
+	return d->sendCommand(command, args, msgOverrides);
+}
+
+QList<QDiscordReply *> QDiscordPool::sendCommandToAll(const QString &command, const QJsonObject &args, const QJsonObject &msgOverrides) {
+	QList<QDiscordReply *> r;
+	for(QDiscord *d: instances())
+		r += d->sendCommand(command, args, msgOverrides);
+	return r;
+}
+
+void QDiscordPool::onConnectAttemptFinished(QDiscord *instance) {
+	// Not an attempt started by connectAsync
+	if(instance && !connectingInstances_.remove(instance))
+		return;
+
+	if(!isConnecting())
+		emit connectFinished();
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <QObject>
+#include <QMap>
+#include <QSet>
+
+#include "qdiscord.h"
+
+/// Manages connections to multiple locally running Discord clients (Stable, PTB, Canary, ...), each on its own discord-ipc pipe
+class QDiscordPool : public QObject {
+Q_OBJECT
+
+public:
+	/**
+	 * Starts connecting to all Discord instances that are running and not connected yet, all at once.
+	 * Emits instanceConnected for each connected instance and connectFinished when all the attempts are done.
+	 * Each instance is connected directly through its pipe and stores its OAuth data in discordOauth_$userID.json
+	 * (the pipe indices depend on the order the clients were started in, so they can't identify the account)
+	 */
+	void connectAsync(const QString &clientID, const QString &clientSecret);
+
+	/// Blocking version of connectAsync (runs a local event loop). Returns number of connected instances
+	int connect(const QString &clientID, const QString &clientSecret);
+
+	void disconnect();
+
+	inline bool isConnecting() const {
+		return isStartingConnects_ || !connectingInstances_.isEmpty();
+	}
+
+	/// Returns connected instances, ordered by the pipe index
+	QList<QDiscord *> instances() const;
+
+	/// Returns the instance connected through the given pipe or nullptr
+	QDiscord *instance(int pipeIndex) const;
+
+	/// Returns whether any of the instances is processing something
+	bool isProcessing() const;
+
+public:
+	/// Sends the command to the instance connected through the given pipe. Returns nullptr if there is no such instance.
+	QDiscordReply *sendCommand(int pipeIndex, const QString &command, const QJsonObject &args = {}, const QJsonObject &msgOverrides = {});
+
+	/// Sends the command to all connected instances
+	QList<QDiscordReply *> sendCommandToAll(const QString &command, const QJsonObject &args = {}, const QJsonObject &msgOverrides = {});
+
+signals:
+	/// Emitted when any of the instances receives a message that is not a response to a command
+	void messageReceived(QDiscord *instance, const QDiscordMessage &msg);
+
+	void instanceConnected(QDiscord *instance);
+
+	/// instance->pipeIndex() is still valid in the handlers
+	void instanceDisconnected(QDiscord *instance);
+
+	/// Emitted when all connection attempts started by connectAsync are finished
+	void connectFinished();
+
+private:
+	void onConnectAttemptFinished(QDiscord *instance);
+
+private:
+	/// pipeIndex -> instance; the instances are kept after disconnecting so that they can be reused
+	QMap<int, QDiscord *> instances_;
+
+	QSet<QDiscord *> connectingInstances_;
+	bool isStartingConnects_ = false;
+
+};
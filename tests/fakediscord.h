@@ -0,0 +1,147 @@
+#pragma once
+
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QFile>
+#include <QtEndian>
+
+/// Builds a raw message header
+inline QByteArray messageHeader(quint32 opcode, quint32 length) {
+	QByteArray r(8, Qt::Uninitialized);
+	qToLittleEndian(opcode, r.data());
+	qToLittleEndian(length, r.data() + 4);
+	return r;
+}
+
+inline QByteArray messageFrame(const QJsonObject &json, quint32 opcode = 1) {
+	const QByteArray payload = QJsonDocument(json).toJson(QJsonDocument::Compact);
+	return messageHeader(opcode, static_cast<quint32>(payload.size())) + payload;
+}
+
+/// Stores an access token so that QDiscord authenticates without the network
+inline void writeOAuthFile(const QString &fileName) {
+	QFile f(fileName);
+	f.open(QIODevice::WriteOnly);
+	f.write(QJsonDocument(QJsonObject{
+		{"access_token",  "token"},
+		{"refresh_token", QJsonValue::Null},
+	}).toJson());
+}
+
+/**
+ * Stand-in for the Discord client listening on discord-ipc-$pipeIndex, lives in the test thread.
+ * Without a script, it answers the handshake and AUTHENTICATE as a logged in client with the given user ID.
+ * Tests are expected to point TMPDIR to a temporary directory so that a running Discord is not affected.
+ */
+class FakeDiscord {
+
+public:
+	explicit FakeDiscord(int pipeIndex, const QString &userID = "1") : userID_(userID) {
+		const QString name = "discord-ipc-" + QString::number(pipeIndex);
+		QLocalServer::removeServer(name);
+		server_.listen(name);
+
+		QObject::connect(&server_, &QLocalServer::newConnection, &server_, [this] {
+			socket_ = server_.nextPendingConnection();
+			QObject::connect(socket_, &QLocalSocket::readyRead, &server_, [this] {
+				onReadyRead();
+			});
+
+			if(!script.isEmpty())
+				socket_->write(script);
+		});
+	}
+
+public:
+	/// Written right after the client connects instead of acting as Discord
+	QByteArray script;
+
+	/// Commands received after the handshake (cmd, args, nonce, ...)
+	QList<QJsonObject> commands;
+
+	/// Number of commands that arrived together in each read
+	QList<int> commandsPerRead;
+
+public:
+	inline bool isListening() const {
+		return server_.isListening();
+	}
+
+	inline bool isClientConnected() const {
+		return socket_ && socket_->state() == QLocalSocket::ConnectedState;
+	}
+
+	void write(const QByteArray &data) {
+		socket_->write(data);
+		socket_->flush();
+	}
+
+	void send(const QJsonObject &json) {
+		write(messageFrame(json));
+	}
+
+	/// Replies to the command with the given data (or error)
+	void reply(const QJsonObject &command, const QJsonObject &data, bool isError = false) {
+		QJsonObject msg{
+			{"cmd",   command["cmd"]},
+			{"nonce", command["nonce"]},
+			{"data",  data},
+		};
+		if(isError)
+			msg["evt"] = "ERROR";
+
+		send(msg);
+	}
+
+	void closeClient() {
+		socket_->disconnectFromServer();
+	}
+
+private:
+	void onReadyRead() {
+		received_ += socket_->readAll();
+
+		int commandCount = 0;
+		while(received_.size() >= 8) {
+			const quint32 opcode = qFromLittleEndian<quint32>(received_.constData());
+			const qsizetype length = 8 + qFromLittleEndian<quint32>(received_.constData() + 4);
+			if(received_.size() < length)
+				break;
+
+			const QJsonObject json = QJsonDocument::fromJson(received_.mid(8, length - 8)).object();
+			received_.remove(0, length);
+
+			if(!script.isEmpty())
+				continue;
+
+			const QJsonObject user{{"id", userID_}};
+
+			if(opcode == 0)
+				send(QJsonObject{
+					{"cmd",  "DISPATCH"},
+					{"evt",  "READY"},
+					{"data", QJsonObject{{"user", user}}},
+				});
+
+			else if(json["cmd"] == "AUTHENTICATE")
+				reply(json, QJsonObject{{"user", user}});
+
+			else {
+				commands += json;
+				commandCount++;
+			}
+		}
+
+		if(commandCount)
+			commandsPerRead += commandCount;
+	}
+
+private:
+	QString userID_;
+	QLocalServer server_;
+	QLocalSocket *socket_ = nullptr;
+	QByteArray received_;
+
+};
@@ -0,0 +1,150 @@
+#include <QtTest>
+#include <QTemporaryDir>
+#include <QRandomGenerator>
+
+#include "qdiscord.h"
+#include "fakediscord.h"
+
+namespace {
+
+	constexpr int testPipeIndex = 9;
+
+	/// Short read timeout so that the stalled stream cases don't take seconds
+	constexpr int testReadTimeout = 200;
+
+}
+
+class TestQDiscordFraming : public QObject {
+Q_OBJECT
+
+private slots:
+	void initTestCase() {
+		QVERIFY(tmpDir_.isValid());
+		qputenv("TMPDIR", tmpDir_.path().toLocal8Bit());
+		QDir::setCurrent(tmpDir_.path());
+		writeOAuthFile("discordOauth.json");
+	}
+
+	void corruptedHandshake_data() {
+		QTest::addColumn<QByteArray>("script");
+		QTest::addColumn<QString>("error");
+
+		QTest::newRow("opcodeAbove4") << (messageHeader(5, 2) + QByteArray("{}")) << QStringLiteral("ERR 9");
+		QTest::newRow("lengthAboveMax") << messageHeader(1, QDiscord::defaultMaxMessageSize + 1) << QStringLiteral("ERR 9");
+		QTest::newRow("lengthUint32Max") << messageHeader(1, 0xffffffff) << QStringLiteral("ERR 9");
+		QTest::newRow("stalledPayload") << (messageHeader(1, 100) + QByteArray(10, '{')) << QStringLiteral("ERR 9");
+		QTest::newRow("truncatedHeader") << QByteArray(4, '\x01') << QStringLiteral("ERR 9");
+		QTest::newRow("emptyPayload") << messageHeader(1, 0) << QStringLiteral("ERR 8");
+	}
+
+	void corruptedHandshake() {
+		QFETCH(QByteArray, script);
+		QFETCH(QString, error);
+
+		FakeDiscord fake(testPipeIndex);
+		fake.script = script;
+		QVERIFY(fake.isListening());
+
+		QDiscord d;
+		d.setReadTimeout(testReadTimeout);
+		QVERIFY(!d.connect("id", "secret", testPipeIndex));
+		QVERIFY(!d.isConnected());
+		QVERIFY(!d.isConnecting());
+		QCOMPARE(d.connectionError(), error);
+		QCOMPARE(d.pipeIndex(), -1);
+		QVERIFY(d.receiveBufferCapacity() <= QDiscord::receiveBufferRetainSize);
+	}
+
+	void randomHeaders() {
+		constexpr quint32 maxMessageSize = 256;
+		QRandomGenerator rng(1234);
+
+		for(int i = 0; i < 32; i++) {
+			const quint32 opcode = rng.bounded(8);
+			const quint32 length = rng.bounded(2 * maxMessageSize);
+
+			// Always send the full payload when the header is acceptable so that the client does not stall on it
+			QByteArray payload(static_cast<int>(qMin(length, maxMessageSize)), Qt::Uninitialized);
+			for(char &c: payload)
+				c = static_cast<char>(rng.bounded(256));
+
+			FakeDiscord fake(testPipeIndex);
+			fake.script = messageHeader(opcode, length) + payload;
+
+			QDiscord d;
+			d.setReadTimeout(testReadTimeout);
+			d.setMaxMessageSize(static_cast<int>(maxMessageSize));
+			QVERIFY(!d.connect("id", "secret", testPipeIndex));
+			QVERIFY(!d.isConnected());
+
+			if(opcode > 4 || length > maxMessageSize)
+				QCOMPARE(d.connectionError(), QStringLiteral("ERR 9"));
+		}
+	}
+
+	void spikeIsReleased() {
+		FakeDiscord fake(testPipeIndex);
+
+		QDiscord d;
+		d.setReadTimeout(testReadTimeout);
+		QVERIFY(d.connect("id", "secret", testPipeIndex));
+		QCOMPARE(d.pipeIndex(), testPipeIndex);
+
+		int received = 0;
+		QObject::connect(&d, &QDiscord::messageReceived, this, [&received] {
+			received++;
+		});
+
+		QByteArray data = messageFrame(QJsonObject{
+			{"evt",  "NOTIFICATION_CREATE"},
+			{"data", QJsonObject{{"blob", QString(2 * QDiscord::receiveBufferRetainSize, QChar('x'))}}},
+		});
+		for(int i = 0; i < 5; i++)
+			data += messageFrame(QJsonObject{{"evt", "SPEAKING_START"}});
+
+		fake.write(data);
+
+		QTRY_COMPARE_WITH_TIMEOUT(received, 6, 5000);
+		QVERIFY(d.isConnected());
+		QVERIFY(d.receiveBufferCapacity() <= QDiscord::receiveBufferRetainSize);
+	}
+
+	void corruptionFailsPendingReplies() {
+		FakeDiscord fake(testPipeIndex);
+
+		QDiscord d;
+		d.setReadTimeout(testReadTimeout);
+		QVERIFY(d.connect("id", "secret", testPipeIndex));
+
+		int received = 0, disconnected = 0;
+		QObject::connect(&d, &QDiscord::messageReceived, this, [&received] {
+			received++;
+		});
+		QObject::connect(&d, &QDiscord::disconnected, this, [&disconnected, &d] {
+			QCOMPARE(d.pipeIndex(), testPipeIndex);
+			disconnected++;
+		});
+
+		bool replyFailed = false;
+		QDiscordReply *r = d.sendCommand("GET_GUILDS");
+		QObject::connect(r, &QDiscordReply::error, this, [&replyFailed] {
+			replyFailed = true;
+		});
+
+		fake.write(messageHeader(7, 0));
+
+		QTRY_VERIFY_WITH_TIMEOUT(replyFailed, 5000);
+		QCOMPARE(disconnected, 1);
+		QCOMPARE(received, 0);
+		QCOMPARE(d.connectionError(), QStringLiteral("ERR 9"));
+		QCOMPARE(d.pipeIndex(), -1);
+	}
+
+private:
+	QTemporaryDir tmpDir_;
+
+};
+
+QTEST_GUILESS_MAIN(TestQDiscordFraming)
+
+#include "tst_qdiscordframing.moc"
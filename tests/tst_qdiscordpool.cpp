@@ -0,0 +1,87 @@
+#include <QtTest>
+#include <QTemporaryDir>
+
+#include "qdiscordpool.h"
+#include "fakediscord.h"
+
+class TestQDiscordPool : public QObject {
+Q_OBJECT
+
+private slots:
+	void initTestCase() {
+		QVERIFY(tmpDir_.isValid());
+		qputenv("TMPDIR", tmpDir_.path().toLocal8Bit());
+		QDir::setCurrent(tmpDir_.path());
+		writeOAuthFile("discordOauth_user8.json");
+		writeOAuthFile("discordOauth_user9.json");
+	}
+
+	void routing() {
+		FakeDiscord fake8(8, "user8"), fake9(9, "user9");
+
+		QDiscordPool pool;
+		QCOMPARE(pool.connect("id", "secret"), 2);
+		QVERIFY(!pool.isConnecting());
+		QCOMPARE(pool.instance(8)->userID(), QStringLiteral("user8"));
+		QCOMPARE(pool.instance(9)->userID(), QStringLiteral("user9"));
+		QVERIFY(!pool.instance(0));
+
+		// Events are tagged with the instance
+		QList<int> eventPipes;
+		QObject::connect(&pool, &QDiscordPool::messageReceived, this, [&eventPipes](QDiscord *instance) {
+			eventPipes += instance->pipeIndex();
+		});
+		fake9.send(QJsonObject{{"evt", "SPEAKING_START"}});
+		QTRY_COMPARE_WITH_TIMEOUT(eventPipes, QList<int>{9}, 5000);
+
+		// Targeted command reaches only its pipe
+		QVERIFY(pool.sendCommand(8, "GET_GUILDS"));
+		QVERIFY(!pool.sendCommand(3, "GET_GUILDS"));
+		QTRY_COMPARE_WITH_TIMEOUT(fake8.commands.size(), 1, 5000);
+		QTest::qWait(50);
+		QCOMPARE(fake9.commands.size(), 0);
+
+		// Fan out reaches both
+		QCOMPARE(pool.sendCommandToAll("GET_CHANNELS").size(), 2);
+		QTRY_COMPARE_WITH_TIMEOUT(fake8.commands.size(), 2, 5000);
+		QTRY_COMPARE_WITH_TIMEOUT(fake9.commands.size(), 1, 5000);
+		QCOMPARE(fake8.commands.last()["cmd"].toString(), QStringLiteral("GET_CHANNELS"));
+		QCOMPARE(fake9.commands.last()["cmd"].toString(), QStringLiteral("GET_CHANNELS"));
+
+		// Disconnect is tagged with the pipe
+		QList<int> disconnectedPipes;
+		QObject::connect(&pool, &QDiscordPool::instanceDisconnected, this, [&disconnectedPipes](QDiscord *instance) {
+			disconnectedPipes += instance->pipeIndex();
+		});
+		fake8.closeClient();
+		QTRY_COMPARE_WITH_TIMEOUT(disconnectedPipes, QList<int>{8}, 5000);
+		QCOMPARE(pool.instances().size(), 1);
+	}
+
+	void reconnectInDisconnectedHandler() {
+		FakeDiscord fake(9, "user9");
+
+		QDiscordPool pool;
+		QCOMPARE(pool.connect("id", "secret"), 1);
+		QDiscord *d = pool.instance(9);
+
+		bool reconnected = false;
+		QObject::connect(&pool, &QDiscordPool::instanceDisconnected, this, [&reconnected](QDiscord *instance) {
+			if(!reconnected)
+				reconnected = instance->connect("id", "secret", 9);
+		});
+
+		fake.closeClient();
+		QTRY_VERIFY_WITH_TIMEOUT(reconnected, 5000);
+		QVERIFY(d->isConnected());
+		QCOMPARE(d->pipeIndex(), 9);
+	}
+
+private:
+	QTemporaryDir tmpDir_;
+
+};
+
+QTEST_GUILESS_MAIN(TestQDiscordPool)
+
+#include "tst_qdiscordpool.moc"
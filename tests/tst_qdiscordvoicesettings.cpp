@@ -0,0 +1,202 @@
+#include <QtTest>
+#include <QTemporaryDir>
+#include <QJsonArray>
+
+#include "qdiscord.h"
+#include "fakediscord.h"
+
+namespace {
+
+	constexpr int testPipeIndex = 9;
+
+	using Snapshot = QHash<QString, QDiscord::UserVoiceSettings>;
+
+	/// Voice state as Discord sends it (volume in the IPC scale)
+	QJsonObject voiceState(const QString &userID, double ipcVolume, bool mute) {
+		return QJsonObject{
+			{"user",   QJsonObject{{"id", userID}}},
+			{"volume", ipcVolume},
+			{"mute",   mute},
+		};
+	}
+
+}
+
+class TestQDiscordVoiceSettings : public QObject {
+Q_OBJECT
+
+private slots:
+	void initTestCase() {
+		QVERIFY(tmpDir_.isValid());
+		qputenv("TMPDIR", tmpDir_.path().toLocal8Bit());
+		QDir::setCurrent(tmpDir_.path());
+		writeOAuthFile("discordOauth.json");
+	}
+
+	void voiceStateEventsFillCache() {
+		FakeDiscord fake(testPipeIndex);
+		QDiscord d;
+		QVERIFY(d.connect("id", "secret", testPipeIndex));
+
+		fake.send(QJsonObject{
+			{"evt",  "VOICE_STATE_CREATE"},
+			{"data", voiceState("5", 50, true)},
+		});
+		QTRY_VERIFY_WITH_TIMEOUT(d.userVoiceSettings().contains("5"), 5000);
+		QCOMPARE(d.userVoiceSettings().value("5").volume, QDiscord::ipcToUIVolume(50));
+		QCOMPARE(d.userVoiceSettings().value("5").mute, true);
+
+		fake.send(QJsonObject{
+			{"evt",  "VOICE_STATE_UPDATE"},
+			{"data", voiceState("5", 100, false)},
+		});
+		QTRY_COMPARE_WITH_TIMEOUT(d.userVoiceSettings().value("5").mute, false, 5000);
+		QCOMPARE(d.userVoiceSettings().value("5").volume, QDiscord::ipcToUIVolume(100));
+
+		fake.send(QJsonObject{
+			{"evt",  "VOICE_STATE_DELETE"},
+			{"data", voiceState("5", 100, false)},
+		});
+		QTRY_VERIFY_WITH_TIMEOUT(!d.userVoiceSettings().contains("5"), 5000);
+	}
+
+	void getChannelFillsCache() {
+		FakeDiscord fake(testPipeIndex);
+		QDiscord d;
+		QVERIFY(d.connect("id", "secret", testPipeIndex));
+
+		d.sendCommand("GET_CHANNEL");
+		QTRY_COMPARE_WITH_TIMEOUT(fake.commands.size(), 1, 5000);
+		fake.reply(fake.commands.at(0), QJsonObject{
+			{"voice_states", QJsonArray{voiceState("2", 100, false), voiceState("3", 50, true)}},
+		});
+
+		QTRY_COMPARE_WITH_TIMEOUT(d.userVoiceSettings().size(), 2, 5000);
+		QCOMPARE(d.userVoiceSettings().value("3").volume, QDiscord::ipcToUIVolume(50));
+		QCOMPARE(d.userVoiceSettings().value("3").mute, true);
+	}
+
+	void unchangedSnapshotSendsNothing() {
+		FakeDiscord fake(testPipeIndex);
+		QDiscord d;
+		QVERIFY(d.connect("id", "secret", testPipeIndex));
+
+		fake.send(QJsonObject{
+			{"evt",  "VOICE_STATE_UPDATE"},
+			{"data", voiceState("2", 57.3, false)},
+		});
+		QTRY_VERIFY_WITH_TIMEOUT(d.userVoiceSettings().contains("2"), 5000);
+
+		QVERIFY(d.setUsersVoiceSettings(Snapshot{{"2", d.userVoiceSettings().value("2")}}).isEmpty());
+		QTest::qWait(50);
+		QVERIFY(fake.commands.isEmpty());
+	}
+
+	void onlyChangedUsersInOneWrite() {
+		FakeDiscord fake(testPipeIndex);
+		QDiscord d;
+		QVERIFY(d.connect("id", "secret", testPipeIndex));
+
+		for(const QString &userID: {"2", "3", "4"})
+			fake.send(QJsonObject{
+				{"evt",  "VOICE_STATE_UPDATE"},
+				{"data", voiceState(userID, 100, false)},
+			});
+		QTRY_COMPARE_WITH_TIMEOUT(d.userVoiceSettings().size(), 3, 5000);
+
+		const double unchanged = d.userVoiceSettings().value("2").volume;
+		const QList<QDiscordReply *> replies = d.setUsersVoiceSettings(Snapshot{
+			{"2", {unchanged, false}},
+			{"3", {150, false}},
+			{"4", {unchanged, true}},
+		});
+		QCOMPARE(replies.size(), 2);
+
+		QTRY_COMPARE_WITH_TIMEOUT(fake.commands.size(), 2, 5000);
+		QCOMPARE(fake.commandsPerRead, QList<int>{2});
+
+		QHash<QString, QJsonObject> sent;
+		for(const QJsonObject &cmd: fake.commands) {
+			QCOMPARE(cmd["cmd"].toString(), QStringLiteral("SET_USER_VOICE_SETTINGS"));
+			const QJsonObject args = cmd["args"].toObject();
+			sent.insert(args["user_id"].toString(), args);
+		}
+
+		QCOMPARE(sent.size(), 2);
+		QCOMPARE(sent.value("3")["volume"].toDouble(), QDiscord::uiToIPCVolume(150));
+		QCOMPARE(sent.value("4")["mute"].toBool(), true);
+	}
+
+	void errorReplyResends() {
+		FakeDiscord fake(testPipeIndex);
+		QDiscord d;
+		QVERIFY(d.connect("id", "secret", testPipeIndex));
+
+		const Snapshot snapshot{{"2", {50, false}}};
+		QCOMPARE(d.setUsersVoiceSettings(snapshot).size(), 1);
+		QVERIFY(d.setUsersVoiceSettings(snapshot).isEmpty());
+
+		QTRY_COMPARE_WITH_TIMEOUT(fake.commands.size(), 1, 5000);
+		fake.reply(fake.commands.at(0), QJsonObject{{"message", "Nope"}}, true);
+
+		QTRY_VERIFY_WITH_TIMEOUT(!d.userVoiceSettings().contains("2"), 5000);
+		QCOMPARE(d.setUsersVoiceSettings(snapshot).size(), 1);
+	}
+
+	void staleErrorKeepsNewerState() {
+		FakeDiscord fake(testPipeIndex);
+		QDiscord d;
+		QVERIFY(d.connect("id", "secret", testPipeIndex));
+
+		bool firstFailed = false;
+		const QList<QDiscordReply *> first = d.setUsersVoiceSettings(Snapshot{{"2", {50, false}}});
+		QCOMPARE(first.size(), 1);
+		QObject::connect(first.at(0), &QDiscordReply::error, this, [&firstFailed] {
+			firstFailed = true;
+		});
+
+		QCOMPARE(d.setUsersVoiceSettings(Snapshot{{"2", {80, false}}}).size(), 1);
+
+		QTRY_COMPARE_WITH_TIMEOUT(fake.commands.size(), 2, 5000);
+		fake.reply(fake.commands.at(0), QJsonObject{{"message", "Nope"}}, true);
+
+		QTRY_VERIFY_WITH_TIMEOUT(firstFailed, 5000);
+		QVERIFY(d.userVoiceSettings().contains("2"));
+		QCOMPARE(d.userVoiceSettings().value("2").volume, 80.0);
+	}
+
+	void volumeIsClamped() {
+		FakeDiscord fake(testPipeIndex);
+		QDiscord d;
+		QVERIFY(d.connect("id", "secret", testPipeIndex));
+
+		QCOMPARE(d.setUsersVoiceSettings(Snapshot{{"2", {500, false}}}).size(), 1);
+		QCOMPARE(d.userVoiceSettings().value("2").volume, double(QDiscord::maxVoiceVolume));
+
+		QTRY_COMPARE_WITH_TIMEOUT(fake.commands.size(), 1, 5000);
+		QCOMPARE(fake.commands.at(0)["args"].toObject()["volume"].toDouble(), QDiscord::uiToIPCVolume(QDiscord::maxVoiceVolume));
+
+		// Already at the maximum
+		QVERIFY(d.setUsersVoiceSettings(Snapshot{{"2", {300, false}}}).isEmpty());
+	}
+
+	void disconnectedDoesNothing() {
+		FakeDiscord fake(testPipeIndex);
+		QDiscord d;
+		QVERIFY(d.connect("id", "secret", testPipeIndex));
+		d.disconnect();
+
+		QVERIFY(d.setUsersVoiceSettings(Snapshot{{"2", {50, false}}}).isEmpty());
+		QVERIFY(d.userVoiceSettings().isEmpty());
+		QTest::qWait(50);
+		QVERIFY(fake.commands.isEmpty());
+	}
+
+private:
+	QTemporaryDir tmpDir_;
+
+};
+
+QTEST_GUILESS_MAIN(TestQDiscordVoiceSettings)
+
+#include "tst_qdiscordvoicesettings.moc"